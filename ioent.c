@@ -32,14 +32,183 @@
 #include <mhash.h>
 #include <bzlib.h>
 #include <zlib.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <ioent.h>
 
 #define STDBLOCKSIZE 4096
 #define XOR_VERBOSE 0x1
 
+#define MMAP_WINDOW (64 * (1 << 20))
+#define MMAP_ALIGN (2 * (1 << 20)) /* huge page size */
+
+#define ASYNC_NBUF 8
+#define ASYNC_BUFSIZE (1 << 20)
+
+#define IOLIMIT_BURST 0.125 /* sec of budget a bucket can store */
+#define IOLIMIT_ADJUST 0.1 /* sec between two adaptive rate changes */
+#define IOLIMIT_MINRATE (256 * 1024)
+
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS 1
+#endif
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+static struct iolimit {
+	pthread_mutex_t mutex;
+	int active;
+	double rate, iops;
+	long latency;
+	double currate;
+	double btokens, otokens;
+	long avglatency;
+	struct timespec last, lastadj;
+} iol={.mutex=PTHREAD_MUTEX_INITIALIZER};
+
+static inline double tsdiff(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+void iolimit_set(double rate, double iops, long latency)
+{
+	iol.rate=iol.currate=rate;
+	iol.iops=iops;
+	iol.latency=latency;
+	iol.btokens=rate * IOLIMIT_BURST;
+	iol.otokens=iops * IOLIMIT_BURST;
+	iol.active=(rate > 0 || iops > 0);
+	clock_gettime(CLOCK_MONOTONIC, &iol.last);
+	iol.lastadj=iol.last;
+}
+
+void iolimit_mark(struct timespec *t0)
+{
+	if (iol.active && iol.latency)
+		clock_gettime(CLOCK_MONOTONIC, t0);
+}
+
+/* charge count bytes (one operation) to the buckets and sleep when they are
+	 in debt. t0 is the start time of a read (set by iolimit_mark) or NULL */
+void iolimit(struct timespec *t0, ssize_t count)
+{
+	struct timespec now;
+	double elapsed, wait=0;
+	if (!iol.active || count <= 0)
+		return;
+	pthread_mutex_lock(&iol.mutex);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (t0 && iol.latency && iol.rate > 0) {
+		long latency=tsdiff(&now, t0) * 1e6;
+		iol.avglatency=(7 * iol.avglatency + latency) / 8;
+		if (tsdiff(&now, &iol.lastadj) >= IOLIMIT_ADJUST) {
+			if (iol.avglatency > iol.latency) {
+				double floor=(iol.rate < 16 * IOLIMIT_MINRATE) ?
+					iol.rate / 16 : IOLIMIT_MINRATE;
+				iol.currate /= 2;
+				if (iol.currate < floor)
+					iol.currate = floor;
+			} else {
+				iol.currate += iol.rate / 16;
+				if (iol.currate > iol.rate)
+					iol.currate = iol.rate;
+			}
+			iol.lastadj=now;
+		}
+	}
+	elapsed=tsdiff(&now, &iol.last);
+	iol.last=now;
+	if (iol.currate > 0) {
+		iol.btokens += elapsed * iol.currate - count;
+		if (iol.btokens > iol.currate * IOLIMIT_BURST)
+			iol.btokens = iol.currate * IOLIMIT_BURST;
+		if (iol.btokens < 0)
+			wait = -iol.btokens / iol.currate;
+	}
+	if (iol.iops > 0) {
+		iol.otokens += elapsed * iol.iops - 1;
+		if (iol.otokens > iol.iops * IOLIMIT_BURST)
+			iol.otokens = iol.iops * IOLIMIT_BURST;
+		if (iol.otokens < 0 && -iol.otokens / iol.iops > wait)
+			wait = -iol.otokens / iol.iops;
+	}
+	pthread_mutex_unlock(&iol.mutex);
+	if (wait > 0) {
+		struct timespec ts;
+		ts.tv_sec=wait;
+		ts.tv_nsec=(wait - ts.tv_sec) * 1e9;
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/* parse a number with an optional K/M/G (binary) suffix, -1 on error */
+double iolimit_parse(char *s)
+{
+	char *tail;
+	double rv=strtod(s, &tail);
+	if (tail == s || rv < 0)
+		return -1;
+	switch (*tail) {
+		case 'g': case 'G': rv *= 1024;
+			/* fall through */
+		case 'm': case 'M': rv *= 1024;
+			/* fall through */
+		case 'k': case 'K': rv *= 1024; tail++;
+			/* fall through */
+		case 0: break;
+	}
+	return (*tail) ? -1 : rv;
+}
+
+/* spec is "idle", "be" or "be:level" (level 0-7, 0 is the highest) */
+int iolimit_ioprio(char *spec)
+{
+	int class;
+	long data=4;
+	if (strcmp(spec, "idle") == 0) {
+		class=IOPRIO_CLASS_IDLE;
+		data=0;
+	} else if (strncmp(spec, "be", 2) == 0 && (spec[2] == 0 || spec[2] == ':')) {
+		class=IOPRIO_CLASS_BE;
+		if (spec[2] == ':') {
+			char *tail;
+			data=strtol(spec+3, &tail, 10);
+			if (tail == spec+3 || *tail || data < 0 || data > 7) {
+				errno=EINVAL;
+				return -1;
+			}
+		}
+	} else {
+		errno=EINVAL;
+		return -1;
+	}
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, 
+			(class << IOPRIO_CLASS_SHIFT) | data);
+}
+
 ssize_t read_file(struct ioent *d, void *buf, size_t count)
+{
+	struct timespec t0;
+	ssize_t rv;
+	iolimit_mark(&t0);
+	rv=read(d->descr.fd, buf, count);
+	iolimit(&t0, rv);
+	if (d->hash)
+		mhash(d->hash, buf, rv);
+	return rv;
+}
+
+/* the time spent waiting for the sender of a pipe/socket is not disk latency */
+ssize_t read_stream(struct ioent *d, void *buf, size_t count)
 {
 	ssize_t rv=read(d->descr.fd, buf, count);
+	iolimit(NULL, rv);
 	if (d->hash)
 		mhash(d->hash, buf, rv);
 	return rv;
@@ -48,6 +217,7 @@ ssize_t read_file(struct ioent *d, void *buf, size_t count)
 ssize_t read_bz2(struct ioent *d, void *buf, size_t count)
 {
 	ssize_t rv=BZ2_bzread(d->descr.bz, buf, count);
+	iolimit(NULL, rv);
 	if (d->hash && rv >= 0)
 		mhash(d->hash, buf, rv);
 	return rv;
@@ -56,17 +226,193 @@ ssize_t read_bz2(struct ioent *d, void *buf, size_t count)
 ssize_t read_gz(struct ioent *d, void *buf, size_t count)
 {
 	ssize_t rv=gzread(d->descr.gz, buf, count);
+	iolimit(NULL, rv);
 	if (d->hash && rv >= 0)
 		mhash(d->hash, buf, rv);
 	return rv;
 }
 
+ssize_t readptr_mmap(struct ioent *d, void **buf, size_t count)
+{
+	if (d->map.pos >= d->map.size)
+		return 0;
+	if (count > d->map.size - d->map.pos)
+		count = d->map.size - d->map.pos;
+	if (d->map.pos < d->map.winoff || 
+			d->map.pos + count > d->map.winoff + d->map.winlen) {
+		if (d->map.addr)
+			munmap(d->map.addr, d->map.winlen);
+		d->map.winoff = d->map.pos & ~((off_t) MMAP_ALIGN - 1);
+		d->map.winlen = d->map.pos + count - d->map.winoff;
+		if (d->map.winlen < MMAP_WINDOW)
+			d->map.winlen = MMAP_WINDOW;
+		if (d->map.winlen > d->map.size - d->map.winoff)
+			d->map.winlen = d->map.size - d->map.winoff;
+		d->map.addr=mmap(NULL, d->map.winlen, PROT_READ, MAP_SHARED, d->descr.fd, d->map.winoff);
+		if (d->map.addr == MAP_FAILED) {
+			/* e.g. ENOMEM: go on reading the file */
+			d->map.addr=NULL;
+			d->map.winlen=0;
+			if (lseek(d->descr.fd, d->map.pos, SEEK_SET) < 0) {
+				perror("mmap");
+				exit(1);
+			}
+			d->ft=&ftfile;
+			return d->ft->ft_readptr(d, buf, count);
+		}
+		madvise(d->map.addr, d->map.winlen, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		madvise(d->map.addr, d->map.winlen, MADV_HUGEPAGE);
+#endif
+	}
+	*buf=d->map.addr + (d->map.pos - d->map.winoff);
+	d->map.pos += count;
+	if (iol.active && iol.latency) {
+		/* adaptive mode: fault the pages in now to sample the read latency */
+		struct timespec t0;
+		size_t i;
+		iolimit_mark(&t0);
+		for (i=0; i<count; i+=STDBLOCKSIZE)
+			(void) ((volatile char *) *buf)[i];
+		iolimit(&t0, count);
+	} else
+		iolimit(NULL, count);
+	if (d->hash)
+		mhash(d->hash, *buf, count);
+	return count;
+}
+
+ssize_t read_mmap(struct ioent *d, void *buf, size_t count)
+{
+	void *data=buf;
+	ssize_t rv=readptr_mmap(d, &data, count);
+	if (rv > 0 && data != buf)
+		memcpy(buf, data, rv);
+	return rv;
+}
+
+ssize_t readptr_copy(struct ioent *d, void **buf, size_t count)
+{
+	return d->ft->ft_read(d, *buf, count);
+}
+
+/* async: a reader thread fills a ring of ASYNC_NBUF buffers using the
+	 read function of the wrapped file type (one read per buffer) */
+struct ioasync {
+	struct filetype *ft;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t notempty, notfull;
+	int head, tail, count;
+	int eof, error, stop;
+	int release; /* head buffer returned by pointer, free it at the next read */
+	size_t pos;
+	struct {
+		char *data;
+		size_t len;
+	} buf[ASYNC_NBUF];
+};
+
+static void *async_reader(void *arg)
+{
+	struct ioent *d=arg;
+	struct ioasync *a=d->async;
+	ssize_t n;
+	do {
+		char *data;
+		pthread_mutex_lock(&a->mutex);
+		while (a->count == ASYNC_NBUF && !a->stop)
+			pthread_cond_wait(&a->notfull, &a->mutex);
+		if (a->stop) {
+			pthread_mutex_unlock(&a->mutex);
+			break;
+		}
+		data=a->buf[a->tail].data;
+		pthread_mutex_unlock(&a->mutex);
+		/* publish each read at once: a stream may stall before filling the buffer */
+		n=a->ft->ft_read(d, data, ASYNC_BUFSIZE);
+		pthread_mutex_lock(&a->mutex);
+		if (n > 0) {
+			a->buf[a->tail].len=n;
+			a->tail=(a->tail + 1) % ASYNC_NBUF;
+			a->count++;
+		} else {
+			a->eof=1;
+			a->error=(n < 0);
+		}
+		pthread_cond_signal(&a->notempty);
+		pthread_mutex_unlock(&a->mutex);
+	} while (n > 0);
+	return NULL;
+}
+
+static inline void async_release(struct ioasync *a)
+{
+	a->head=(a->head + 1) % ASYNC_NBUF;
+	a->count--;
+	a->pos=0;
+	a->release=0;
+	pthread_cond_signal(&a->notfull);
+}
+
+/* copy count bytes to buf or, when ptr != NULL and the data is contiguous,
+	 set *ptr to the data in the buffer */
+static ssize_t async_get(struct ioent *d, char *buf, void **ptr, size_t count)
+{
+	struct ioasync *a=d->async;
+	ssize_t done=0;
+	pthread_mutex_lock(&a->mutex);
+	if (a->release)
+		async_release(a);
+	while (done < count) {
+		size_t len;
+		char *data;
+		while (a->count == 0 && !a->eof)
+			pthread_cond_wait(&a->notempty, &a->mutex);
+		if (a->count == 0)
+			break;
+		data=a->buf[a->head].data + a->pos;
+		len=a->buf[a->head].len - a->pos;
+		if (ptr && done == 0 && len >= count && a->pos % sizeof(unsigned long) == 0) {
+			*ptr=data;
+			a->pos += count;
+			a->release=(a->pos == a->buf[a->head].len);
+			done=count;
+			break;
+		}
+		if (len > count - done)
+			len = count - done;
+		pthread_mutex_unlock(&a->mutex);
+		memcpy(buf+done, data, len);
+		pthread_mutex_lock(&a->mutex);
+		done += len;
+		a->pos += len;
+		if (a->pos == a->buf[a->head].len)
+			async_release(a);
+	}
+	if (done == 0 && a->error)
+		done=-1;
+	pthread_mutex_unlock(&a->mutex);
+	return done;
+}
+
+ssize_t read_async(struct ioent *d, void *buf, size_t count)
+{
+	return async_get(d, buf, NULL, count);
+}
+
+ssize_t readptr_async(struct ioent *d, void **buf, size_t count)
+{
+	return async_get(d, *buf, buf, count);
+}
+
 ssize_t write_file(struct ioent *d, long nonzero, void *buf, size_t count, off_t offset)
 {
 	ssize_t rv;
-	if (nonzero)
+	if (nonzero) {
 		rv=pwrite(d->descr.fd, buf, count, offset);
-	else
+		iolimit(NULL, rv);
+	} else
 		rv=count;
 	if (d->hash && rv >= 0)
 		mhash(d->hash, buf, rv);
@@ -76,6 +422,7 @@ ssize_t write_file(struct ioent *d, long nonzero, void *buf, size_t count, off_t
 ssize_t write_stream(struct ioent *d, long nonzero, void *buf, size_t count, off_t offset)
 {
 	ssize_t rv=write(d->descr.fd, buf, count);
+	iolimit(NULL, rv);
 	if (d->hash && rv >= 0)
 		mhash(d->hash, buf, rv);
 	return rv;
@@ -84,6 +431,7 @@ ssize_t write_stream(struct ioent *d, long nonzero, void *buf, size_t count, off
 ssize_t write_bz2(struct ioent *d, long nonzero, void *buf, size_t count, off_t offset)
 {
 	ssize_t rv=BZ2_bzwrite(d->descr.bz, buf, count);
+	iolimit(NULL, rv);
 	if (d->hash && rv >= 0)
 		mhash(d->hash, buf, rv);
 	return rv;
@@ -92,6 +440,7 @@ ssize_t write_bz2(struct ioent *d, long nonzero, void *buf, size_t count, off_t
 ssize_t write_gz(struct ioent *d, long nonzero, void *buf, size_t count, off_t offset)
 {
 	ssize_t rv=gzwrite(d->descr.gz, buf, count);
+	iolimit(NULL, rv);
 	if (d->hash && rv >= 0)
 		mhash(d->hash, buf, rv);
 	return rv;
@@ -102,6 +451,35 @@ int close_file(struct ioent *d)
 	return close(d->descr.fd);
 }
 
+int close_mmap(struct ioent *d)
+{
+	if (d->map.addr)
+		munmap(d->map.addr, d->map.winlen);
+	return close(d->descr.fd);
+}
+
+int close_async(struct ioent *d)
+{
+	struct ioasync *a=d->async;
+	int i, eof;
+	pthread_mutex_lock(&a->mutex);
+	a->stop=1;
+	eof=a->eof;
+	pthread_cond_signal(&a->notfull);
+	pthread_mutex_unlock(&a->mutex);
+	/* the rest of the input is not needed: do not wait for a reader
+		 blocked in read() (e.g. on a pipe), read() is a cancellation point */
+	if (!eof)
+		pthread_cancel(a->thread);
+	pthread_join(a->thread, NULL);
+	d->ft=a->ft;
+	for (i=0; i<ASYNC_NBUF; i++)
+		free(a->buf[i].data);
+	free(a);
+	d->async=NULL;
+	return d->ft->ft_close(d);
+}
+
 int close_bz2(struct ioent *d)
 {
 	BZ2_bzclose(d->descr.bz);
@@ -123,10 +501,12 @@ int truncate_file(struct ioent *d, off_t len)
 	return ftruncate(d->descr.fd, len);
 }
 
-struct filetype ftfile={read_file, write_file, truncate_file, close_file};
-struct filetype ftstream={read_file, write_stream, no_truncate, close_file};
-struct filetype ftbz2={read_bz2, write_bz2, no_truncate, close_bz2};
-struct filetype ftgz={read_gz, write_gz, no_truncate, close_gz};
+struct filetype ftfile={read_file, readptr_copy, write_file, truncate_file, close_file};
+struct filetype ftstream={read_stream, readptr_copy, write_stream, no_truncate, close_file};
+struct filetype ftbz2={read_bz2, readptr_copy, write_bz2, no_truncate, close_bz2};
+struct filetype ftgz={read_gz, readptr_copy, write_gz, no_truncate, close_gz};
+struct filetype ftmmap={read_mmap, readptr_mmap, write_file, truncate_file, close_mmap};
+struct filetype ftasync={read_async, readptr_async, write_stream, no_truncate, close_async};
 
 static char hex[]="0123456789abcdef";
 void printhash(MHASH td, char *name, char *arg)
@@ -185,3 +565,44 @@ void open_ioent(struct ioent *fx, char *filename, int flags, int mode)
 		}
 	}
 }
+
+void mmap_ioent(struct ioent *fx)
+{
+	struct stat st;
+	if (fx->ft == &ftfile && fstat(fx->descr.fd,&st) == 0 && S_ISREG(st.st_mode)) {
+		fx->ft = &ftmmap;
+		fx->map.addr = NULL;
+		fx->map.winoff = fx->map.winlen = 0;
+		fx->map.pos = lseek(fx->descr.fd, 0, SEEK_CUR);
+		fx->map.size = st.st_size;
+		if (fx->map.pos < 0)
+			fx->map.pos = 0;
+	}
+}
+
+void async_ioent(struct ioent *fx)
+{
+	struct ioasync *a=calloc(1, sizeof(struct ioasync));
+	int i;
+	if (a == NULL) {
+		fprintf(stderr,"memory error");
+		exit(1);
+	}
+	for (i=0; i<ASYNC_NBUF; i++) {
+		a->buf[i].data=malloc(ASYNC_BUFSIZE);
+		if (a->buf[i].data == NULL) {
+			fprintf(stderr,"memory error");
+			exit(1);
+		}
+	}
+	a->ft=fx->ft;
+	pthread_mutex_init(&a->mutex, NULL);
+	pthread_cond_init(&a->notempty, NULL);
+	pthread_cond_init(&a->notfull, NULL);
+	fx->async=a;
+	fx->ft=&ftasync;
+	if (pthread_create(&a->thread, NULL, async_reader, fx) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+}
@@ -32,14 +32,25 @@
 #include <mhash.h>
 #include <bzlib.h>
 #include <zlib.h>
+#include <time.h>
 
 #define STDBLOCKSIZE 4096
 #define XOR_VERBOSE 0x1
 
+/* long only options shared by xordiff and sparsify */
+#define OPT_MAXRATE 0x100
+#define OPT_MAXIOPS 0x101
+#define OPT_IOPRIO 0x102
+#define OPT_LATENCY 0x103
+
 struct ioent;
+struct ioasync;
 
 struct filetype {
 	ssize_t (*ft_read)(struct ioent *d, void *buf, size_t count);
+	/* like ft_read, but *buf can be changed to point to the data
+		 (valid up to the next read): *buf is the buffer for copying file types */
+	ssize_t (*ft_readptr)(struct ioent *d, void **buf, size_t count);
 	ssize_t (*ft_write)(struct ioent *d, long nonzero, void *buf, size_t count, off_t offset);
 	int (*ft_truncate)(struct ioent *d, off_t len);
 	int (*ft_close)(struct ioent *d);
@@ -53,13 +64,37 @@ struct ioent {
 		gzFile gz;
 	} descr;
 	MHASH hash;
+	struct {
+		char *addr;
+		off_t winoff;
+		size_t winlen;
+		off_t pos, size;
+	} map;
+	struct ioasync *async;
 };
 
 struct filetype ftfile;
 struct filetype ftstream;
 struct filetype ftbz2;
 struct filetype ftgz;
+struct filetype ftmmap;
+struct filetype ftasync;
 
 void printhash(MHASH td, char *name, char *arg);
 void open_ioent(struct ioent *fx, char *filename, int flags, int mode);
+/* read a regular file input through a mmap window (no effect on other types) */
+void mmap_ioent(struct ioent *fx);
+/* read an input in a separate thread (decompression overlaps the other I/O).
+	 The hash must be set before: the thread starts reading immediately */
+void async_ioent(struct ioent *fx);
+
+/* iolimit: token bucket limiter for all the I/O operations of the process.
+	 rate is in bytes/sec, iops in operations/sec (0 means unlimited).
+	 When latency (usec) is set, the rate adapts: it is halved when the observed
+	 read latency exceeds the target and slowly increases up to rate otherwise */
+void iolimit_set(double rate, double iops, long latency);
+void iolimit_mark(struct timespec *t0);
+void iolimit(struct timespec *t0, ssize_t count);
+double iolimit_parse(char *s);
+int iolimit_ioprio(char *spec);
 #endif
@@ -48,11 +48,16 @@
 #define SPARSIFY_VERBOSE 0x1
 #define SPARSIFY_DELETE 0x2
 #define SPARSIFY_COPY 0x4
+#define SPARSIFY_MMAP 0x8
 #define SPARSIFY_FORCE1 0x10
 #define SPARSIFY_FORCE2 0x20
 #define SPARSIFY_FORCE3 0x40
 #define SPARSIFY_HASH1 0x100
 #define SPARSIFY_HASH2 0x200
+#define SPARSIFY_RESUME 0x1000
+#define SPARSIFY_ROLLBACK 0x2000
+#define OPT_RESUME 0x200
+#define OPT_ROLLBACK 0x201
 #ifndef FALLOC_FL_PUNCH_HOLE
 #define FALLOC_FL_PUNCH_HOLE 0x02
 #endif
@@ -84,28 +89,287 @@ inline unsigned long iszero(unsigned long *b, int bufsize)
 	return 1;
 }
 
-void dangerous_sparsify(int fd, int fdout, off_t filesize, int blocksize, int verbose)
+/* name of a hidden file in the same directory of path: dir/.base<suffix> */
+static char *sidename(char *path, char *suffix)
 {
-	register off_t offset;
-	register int bufsize=blocksize / sizeof(unsigned long);
-	unsigned long buf[bufsize];
-	ssize_t n;
-	for (offset=((filesize + blocksize - 1) / blocksize) * blocksize; 
-			offset >= 0; offset -= blocksize) {
-		n=pread(fd,buf,blocksize,offset);
-		//printf("READ %lld %d\n",offset,n);
-		if (__builtin_expect(n<blocksize,0))
-			memset(((char *)buf)+n, 0, blocksize-n);
-		if (!iszero(buf,bufsize) && n > 0) {
-			//printf("WRITE %lld %d\n",offset,n);
-			pwrite(fdout,buf,n,offset);
+	char *dircopy=strdup(path);
+	char *basecopy=strdup(path);
+	char *rv;
+	if (asprintf(&rv,"%s/.%s%s",dirname(dircopy),basename(basecopy),suffix) < 0) {
+		fprintf(stderr,"memory error");
+		exit(1);
+	}
+	free(dircopy);
+	free(basecopy);
+	return rv;
+}
+
+static void syncdir(char *path)
+{
+	char *dircopy=strdup(path);
+	int fd=open(dirname(dircopy),O_RDONLY|O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dircopy);
+}
+
+/* in place compaction (-fff).
+	 The file is copied backwards to a sparse temporary file, COMPACT_STEP bytes
+	 at a time, and truncated after each step, so it needs just COMPACT_STEP bytes
+	 of free disk space. The journal records the offset "done": the file has
+	 valid data in [0,done) and the temporary file in [done,filesize).
+	 done is updated (and synced) after the copy and before the truncation
+	 of each step, so an interrupted run can be resumed or rolled back */
+#define COMPACT_STEP (64 * (1 << 20))
+#define COMPACT_BUFSIZE (1 << 20)
+#define COMPACT_MAGIC "SPJRNL01"
+#define COMPACT_JOURNAL ".spj"
+
+struct compact_journal {
+	char magic[8];
+	off_t filesize;
+	off_t done;
+	char tmpsuffix[32];
+};
+
+static void compact_fail(char *msg)
+{
+	perror(msg);
+	fprintf(stderr,"compaction interrupted: use --resume or --rollback\n");
+	exit(1);
+}
+
+static void journal_write(int fdj, struct compact_journal *j)
+{
+	if (pwrite(fdj,j,sizeof(*j),0) != sizeof(*j) || fdatasync(fdj) < 0)
+		compact_fail("journal");
+}
+
+static int journal_read(char *jname, struct compact_journal *j)
+{
+	int fdj=open(jname,O_RDWR);
+	if (fdj < 0) {
+		perror(jname);
+		exit(1);
+	}
+	if (pread(fdj,j,sizeof(*j),0) != sizeof(*j) ||
+			memcmp(j->magic,COMPACT_MAGIC,sizeof(j->magic)) != 0) {
+		fprintf(stderr,"%s: bad journal\n",jname);
+		exit(1);
+	}
+	j->tmpsuffix[sizeof(j->tmpsuffix)-1]=0;
+	return fdj;
+}
+
+static void pwrite_all(int fd, char *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t n=pwrite(fd,buf,len,offset);
+		iolimit(NULL, n);
+		if (n < 0)
+			compact_fail("pwrite");
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+}
+
+/* copy [from,to) of fdin to fdout, one write per run of non-zero blocks */
+static void copy_nonzero(int fdin, int fdout, off_t from, off_t to, 
+		char *buf, int bufsize, int blocksize)
+{
+	register int words=blocksize / sizeof(unsigned long);
+	off_t offset;
+	for (offset=from; offset < to; offset += bufsize) {
+		size_t len=(to - offset < bufsize) ? to - offset : bufsize;
+		size_t i, run;
+		ssize_t n;
+		struct timespec t0;
+		iolimit_mark(&t0);
+		n=pread(fdin,buf,len,offset);
+		iolimit(&t0, n);
+		if (n != len)
+			compact_fail("pread");
+		if (__builtin_expect(len % blocksize, 0))
+			memset(buf+len, 0, blocksize - len % blocksize);
+		for (i=run=0; i<len; i+=blocksize) {
+			if (iszero((unsigned long *)(buf+i),words)) {
+				if (i > run)
+					pwrite_all(fdout,buf+run,i-run,offset+run);
+				run=i+blocksize;
+			}
 		}
-		ftruncate(fd,offset);
-		if (verbose) verboseprint(filesize - offset);
+		if (len > run)
+			pwrite_all(fdout,buf+run,len-run,offset+run);
+	}
+}
+
+static char *compact_buf(int blocksize, int *bufsize)
+{
+	char *buf;
+	*bufsize=(COMPACT_BUFSIZE / blocksize) * blocksize;
+	if (*bufsize < blocksize)
+		*bufsize = blocksize;
+	buf=malloc(*bufsize);
+	if (buf == NULL) {
+		fprintf(stderr,"memory error");
+		exit(1);
+	}
+	return buf;
+}
+
+static void compact_run(int fd, int fdout, int fdj, struct compact_journal *j,
+		char *path, char *tmpfile, char *jname, int blocksize, int verbose)
+{
+	int bufsize;
+	char *buf=compact_buf(blocksize, &bufsize);
+	off_t step=(COMPACT_STEP / bufsize) * bufsize;
+	if (step < bufsize)
+		step = bufsize;
+	while (j->done > 0) {
+		off_t start=((j->done - 1) / step) * step;
+		copy_nonzero(fd,fdout,start,j->done,buf,bufsize,blocksize);
+		if (fdatasync(fdout) < 0)
+			compact_fail(tmpfile);
+		j->done=start;
+		journal_write(fdj,j);
+		if (ftruncate(fd,start) < 0)
+			compact_fail(path);
+		if (verbose) verboseprint(j->filesize - start);
 	}
 	if (verbose) fprintf(stderr, "\n");
+	free(buf);
 	close(fd);
+	if (fsync(fdout) < 0)
+		compact_fail(tmpfile);
 	close(fdout);
+	if (rename(tmpfile,path) < 0)
+		compact_fail(tmpfile);
+	syncdir(path);
+	close(fdj);
+	unlink(jname);
+}
+
+void compact_sparsify(int fd, char *path, off_t filesize, int mode, int blocksize, int verbose)
+{
+	struct compact_journal j;
+	char *jname=sidename(path,COMPACT_JOURNAL);
+	char *tmpfile, *jtmp;
+	char jsuffix[64];
+	int fdj, fdout;
+	memset(&j,0,sizeof(j));
+	memcpy(j.magic,COMPACT_MAGIC,sizeof(j.magic));
+	j.filesize=j.done=filesize;
+	snprintf(j.tmpsuffix,sizeof(j.tmpsuffix),".sp%d",getpid());
+	tmpfile=sidename(path,j.tmpsuffix);
+	/* the journal is written to a temporary name and then linked: a journal
+		 is never partially written and link fails if it already exists */
+	snprintf(jsuffix,sizeof(jsuffix),"%s%s",COMPACT_JOURNAL,j.tmpsuffix);
+	jtmp=sidename(path,jsuffix);
+	fdj=open(jtmp,O_WRONLY|O_CREAT|O_EXCL,0600);
+	if (fdj < 0) {
+		perror(jtmp);
+		exit(1);
+	}
+	if (pwrite(fdj,&j,sizeof(j),0) != sizeof(j) || fdatasync(fdj) < 0 ||
+			link(jtmp,jname) < 0) {
+		perror(jname);
+		unlink(jtmp);
+		exit(1);
+	}
+	unlink(jtmp);
+	fdout=open(tmpfile,O_WRONLY|O_CREAT|O_EXCL,mode);
+	if (fdout < 0) {
+		perror(tmpfile);
+		unlink(jname);
+		exit(1);
+	}
+	if (ftruncate(fdout,filesize) < 0 || fsync(fdout) < 0) {
+		perror(tmpfile);
+		unlink(tmpfile);
+		unlink(jname);
+		exit(1);
+	}
+	syncdir(path);
+	compact_run(fd,fdout,fdj,&j,path,tmpfile,jname,blocksize,verbose);
+}
+
+/* complete an interrupted compaction */
+void compact_resume(char *path, int blocksize, int verbose)
+{
+	struct compact_journal j;
+	char *jname=sidename(path,COMPACT_JOURNAL);
+	int fdj=journal_read(jname,&j);
+	char *tmpfile=sidename(path,j.tmpsuffix);
+	struct stat st;
+	int fd, fdout;
+	if (j.done == 0 && access(tmpfile,F_OK) < 0) {
+		/* interrupted after the rename */
+		close(fdj);
+		unlink(jname);
+		return;
+	}
+	fd=open(path,O_RDWR);
+	if (fd < 0 || fstat(fd,&st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (blocksize == 0)
+		blocksize = st.st_blksize;
+	fdout=open(tmpfile,O_WRONLY|O_CREAT,st.st_mode&0777);
+	if (fdout < 0 || ftruncate(fdout,j.filesize) < 0) {
+		perror(tmpfile);
+		exit(1);
+	}
+	compact_run(fd,fdout,fdj,&j,path,tmpfile,jname,blocksize,verbose);
+}
+
+/* undo an interrupted compaction: copy back [done,filesize) from the
+	 temporary file. The data in [done,filesize) of the file is either
+	 the original data or a hole, so writing the non-zero blocks suffices */
+void compact_rollback(char *path, int blocksize)
+{
+	struct compact_journal j;
+	char *jname=sidename(path,COMPACT_JOURNAL);
+	int fdj=journal_read(jname,&j);
+	char *tmpfile=sidename(path,j.tmpsuffix);
+	struct stat st;
+	int fd, fdin;
+	char *buf;
+	int bufsize;
+	fdin=open(tmpfile,O_RDONLY);
+	if (fdin < 0) {
+		if (errno == ENOENT && (j.done == 0 || j.done == j.filesize)) {
+			/* already complete or nothing done yet */
+			close(fdj);
+			unlink(jname);
+			return;
+		}
+		perror(tmpfile);
+		exit(1);
+	}
+	fd=open(path,O_WRONLY);
+	if (fd < 0 || fstat(fd,&st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (blocksize == 0)
+		blocksize = st.st_blksize;
+	buf=compact_buf(blocksize, &bufsize);
+	copy_nonzero(fdin,fd,j.done,j.filesize,buf,bufsize,blocksize);
+	free(buf);
+	if (ftruncate(fd,j.filesize) < 0 || fsync(fd) < 0) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+	close(fdin);
+	unlink(tmpfile);
+	syncdir(path);
+	close(fdj);
+	unlink(jname);
 }
 
 void real_sparsify(int fd, int blocksize, int verbose)
@@ -114,8 +378,11 @@ void real_sparsify(int fd, int blocksize, int verbose)
 	register int bufsize=blocksize / sizeof(unsigned long);
 	unsigned long buf[bufsize];
 	ssize_t n;
+	struct timespec t0;
 	for (offset=0, n=blocksize; n >= blocksize; offset += n) {
+		iolimit_mark(&t0);
 		n=read(fd,buf,blocksize);
+		iolimit(&t0, n);
 		if (__builtin_expect(n<blocksize,0))
 			memset(((char *)buf)+n, 0, blocksize-n);
 		if (iszero(buf,bufsize) && n > 0) {
@@ -136,12 +403,18 @@ void copy_sparsify(struct ioent *fin, struct ioent *fout, int blocksize, int ver
 	register off_t offset;
 	register int bufsize=blocksize / sizeof(unsigned long);
 	unsigned long buf[bufsize];
+	unsigned long *p;
 	ssize_t n;
 	for (offset=0,n=blocksize; n>=blocksize; offset+=n) {
-		n=fin->ft->ft_read(fin,buf,blocksize);
-		if (__builtin_expect(n<blocksize,0))
+		p=buf;
+		n=fin->ft->ft_readptr(fin,(void **)&p,blocksize);
+		if (__builtin_expect(n<blocksize,0)) {
+			if (p != buf && n > 0)
+				memcpy(buf, p, n);
+			p=buf;
 			memset(((char *)buf)+n, 0, blocksize-n);
-		fout->ft->ft_write(fout,!iszero(buf,bufsize) && n>0, buf, n, offset);
+		}
+		fout->ft->ft_write(fout,!iszero(p,bufsize) && n>0, p, n, offset);
 		if (verbose) verboseprint(offset);
 	}
 	if (verbose) fprintf(stderr, "\n");
@@ -152,8 +425,11 @@ void copy_sparsify(struct ioent *fin, struct ioent *fout, int blocksize, int ver
 
 void usage(char *progname)
 {
-  fprintf(stderr,"Usage: %s [-d] file1 file2\n"
-			           "       %s [-fff][-c] file\n",progname,progname);
+  fprintf(stderr,"Usage: %s [-d][-m] file1 file2\n"
+			           "       %s [-fff][-c [-m]] file\n"
+			           "       %s --resume|--rollback file\n"
+			           "  I/O limits: [--max-rate bytes] [--max-iops n] [--ioprio idle|be[:level]]\n"
+			           "              [--target-latency usec]\n",progname,progname,progname);
 	exit(1);
 }
 
@@ -162,6 +438,10 @@ int main(int argc, char *argv[])
 	int blocksize=0;
 	static int flags;
 	int fd;
+	double maxrate=0, maxiops=0;
+	long latency=0;
+	char *ioprio=NULL;
+	char *tail;
 
 	while (1) {
 		int option_index = 0;
@@ -170,12 +450,19 @@ int main(int argc, char *argv[])
 			{"help", no_argument, 0,  'h' },
 			{"force", no_argument, 0,  'f' },
 			{"verbose", no_argument, 0,  'v' },
+			{"mmap", no_argument, 0,  'm' },
 			{"bufsize", required_argument, 0,  's' },
 			{"delete", required_argument, 0,  'd' },
 			{"copy", required_argument, 0,  'c' },
+			{"resume", no_argument, 0,  OPT_RESUME },
+			{"rollback", no_argument, 0,  OPT_ROLLBACK },
+			{"max-rate", required_argument, 0,  OPT_MAXRATE },
+			{"max-iops", required_argument, 0,  OPT_MAXIOPS },
+			{"ioprio", required_argument, 0,  OPT_IOPRIO },
+			{"target-latency", required_argument, 0,  OPT_LATENCY },
 			{0,         0,                 0,  0 }
 		};
-		c = getopt_long(argc, argv, "hfdscv12",
+		c = getopt_long(argc, argv, "hfdscvm12",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -183,10 +470,19 @@ int main(int argc, char *argv[])
 		switch(c) {
 			case 's' : blocksize=atoi(optarg); break;
 			case 'v': flags |= SPARSIFY_VERBOSE; break;
+			case 'm': flags |= SPARSIFY_MMAP; break;
 			case 'd': flags |= SPARSIFY_DELETE; break;
 			case 'c': flags |= SPARSIFY_COPY; break;
 			case '1': flags |= SPARSIFY_HASH1; break;
 			case '2': flags |= SPARSIFY_HASH2; break;
+			case OPT_RESUME: flags |= SPARSIFY_RESUME; break;
+			case OPT_ROLLBACK: flags |= SPARSIFY_ROLLBACK; break;
+			case OPT_MAXRATE: if ((maxrate=iolimit_parse(optarg)) < 0) usage(argv[0]); break;
+			case OPT_MAXIOPS: if ((maxiops=iolimit_parse(optarg)) < 0) usage(argv[0]); break;
+			case OPT_IOPRIO: ioprio=optarg; break;
+			case OPT_LATENCY: latency=strtol(optarg,&tail,10);
+												if (tail == optarg || *tail || latency < 0) usage(argv[0]);
+												break;
 			case 'f': if (flags & SPARSIFY_FORCE2)
 									flags |= SPARSIFY_FORCE3;
 								else if (flags & SPARSIFY_FORCE1)
@@ -218,11 +514,26 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	if ((flags & SPARSIFY_FORCE1) && !(flags & SPARSIFY_FORCE3)) {
-		fprintf(stderr,"-f option is very dangerous\n"
-				"incomplete executions result in non recoverable corruption of data\n"
+		fprintf(stderr,"-f option modifies the file in place\n"
+				"incomplete executions must be completed by --resume or undone by --rollback\n"
 				"-f must be set three times -fff\n");
 		exit(1);
 	}
+	if ((flags & (SPARSIFY_RESUME | SPARSIFY_ROLLBACK)) && 
+			(argc==3 || (flags & (SPARSIFY_FORCE1 | SPARSIFY_COPY)) ||
+			 (flags & SPARSIFY_RESUME && flags & SPARSIFY_ROLLBACK))) {
+		fprintf(stderr,"--resume and --rollback take just one file and no other mode option\n");
+		exit(1);
+	}
+	if (latency > 0 && maxrate == 0) {
+		fprintf(stderr,"--target-latency requires --max-rate\n");
+		exit(1);
+	}
+	if (ioprio && iolimit_ioprio(ioprio) < 0) {
+		perror("ioprio");
+		exit(1);
+	}
+	iolimit_set(maxrate, maxiops, latency);
 
 	if (argc==3) {
 		/* copy mode */
@@ -242,6 +553,8 @@ int main(int argc, char *argv[])
 		}
 		open_ioent(&fin,argv[1],O_RDONLY,0);
 		if (flags & SPARSIFY_HASH1) fin.hash=mhash_init(MHASH_SHA1);
+		if (flags & SPARSIFY_MMAP) mmap_ioent(&fin);
+		if (fin.ft != &ftfile && fin.ft != &ftmmap) async_ioent(&fin);
 		if (flags & SPARSIFY_HASH2) fout.hash=mhash_init(MHASH_SHA1);
 		copy_sparsify(&fin,&fout,blocksize,flags & SPARSIFY_VERBOSE);
 		if (flags & SPARSIFY_DELETE)
@@ -251,6 +564,20 @@ int main(int argc, char *argv[])
 	} else {
 		/* on the same file */
 		struct stat st;
+		char *jname=sidename(argv[1],COMPACT_JOURNAL);
+		if (flags & SPARSIFY_RESUME) {
+			compact_resume(argv[1],blocksize,flags & SPARSIFY_VERBOSE);
+			return 0;
+		}
+		if (flags & SPARSIFY_ROLLBACK) {
+			compact_rollback(argv[1],blocksize);
+			return 0;
+		}
+		if (access(jname,F_OK) == 0) {
+			fprintf(stderr,"%s: interrupted compaction found (%s)\n"
+					"use --resume or --rollback\n",argv[1],jname);
+			exit(1);
+		}
 		fd=open(argv[1],O_RDWR);
 		if (fd < 0) {
 			perror(argv[1]);
@@ -263,22 +590,22 @@ int main(int argc, char *argv[])
 		}
 		if (blocksize == 0)
 			blocksize = st.st_blksize;
-		if ((flags & SPARSIFY_COPY) || (flags & SPARSIFY_FORCE3)) {
+		if (flags & SPARSIFY_FORCE3)
+			compact_sparsify(fd,argv[1],st.st_size,st.st_mode&0777,blocksize,flags & SPARSIFY_VERBOSE);
+		else if (flags & SPARSIFY_COPY) {
+			char suffix[32];
 			char *tmpfile;
-			asprintf(&tmpfile,"%s/.%s.sp%d",dirname(argv[1]),basename(argv[1]),getpid());
+			snprintf(suffix,sizeof(suffix),".sp%d",getpid());
+			tmpfile=sidename(argv[1],suffix);
 			int fdout=open(tmpfile,O_WRONLY|O_TRUNC|O_CREAT|O_EXCL,st.st_mode&0777);
 			if (fdout < 0) {
 				perror(tmpfile);
 				exit(1);
 			}
-			if (flags & SPARSIFY_COPY) {
-				struct ioent fin={.ft=&ftfile, .descr.fd=fd, .hash=NULL};
-				struct ioent fout={.ft=&ftfile, .descr.fd=fdout, .hash=NULL};
-				copy_sparsify(&fin,&fout,blocksize,flags & SPARSIFY_VERBOSE);
-			} else if (flags & SPARSIFY_FORCE3)
-				dangerous_sparsify(fd,fdout,st.st_size,blocksize,flags & SPARSIFY_VERBOSE);
-			else
-				exit(1);
+			struct ioent fin={.ft=&ftfile, .descr.fd=fd, .hash=NULL};
+			struct ioent fout={.ft=&ftfile, .descr.fd=fdout, .hash=NULL};
+			if (flags & SPARSIFY_MMAP) mmap_ioent(&fin);
+			copy_sparsify(&fin,&fout,blocksize,flags & SPARSIFY_VERBOSE);
 			rename(tmpfile,argv[1]);
 		} else {
 			real_sparsify(fd,blocksize,flags & SPARSIFY_VERBOSE);
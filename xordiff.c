@@ -37,6 +37,7 @@
 
 #define STDBLOCKSIZE 4096
 #define XOR_VERBOSE 0x1
+#define XOR_MMAP 0x2
 #define DOTSIZE 16 * (1 << 20)
 #define XSIZE (1 << 30)
 
@@ -69,6 +70,7 @@ void xorfile(struct ioent *f1, struct ioent *f2, struct ioent *fout,
 	register int bufsize=blocksize / sizeof(unsigned long);
 	register int verbose=flags & XOR_VERBOSE;
 	unsigned long *buf1,*buf2,*buf3,*buf4;
+	unsigned long *p1,*p2;
 	int n1,n2;
 	buf1 = malloc(blocksize);
 	buf2 = malloc(blocksize);
@@ -86,21 +88,32 @@ void xorfile(struct ioent *f1, struct ioent *f2, struct ioent *fout,
 		memset(buf4, 0, sizeof(long) * bufsize);
 	}
 	for (offset1=offset2=0, n2=blocksize; n2 >= blocksize; offset1 += n1, offset2 += n2) {
-		n1=f1->ft->ft_read(f1,buf1,blocksize);
-		n2=f2->ft->ft_read(f2,buf2,blocksize);
-		if (__builtin_expect(n1 < blocksize, 0)) 
+		p1=buf1;
+		p2=buf2;
+		n1=f1->ft->ft_readptr(f1,(void **)&p1,blocksize);
+		n2=f2->ft->ft_readptr(f2,(void **)&p2,blocksize);
+		/* mapped data cannot be padded: short blocks are copied */
+		if (__builtin_expect(n1 < blocksize, 0)) {
+			if (p1 != buf1 && n1 > 0)
+				memcpy(buf1, p1, n1);
+			p1=buf1;
 			memset(((char *)buf1)+n1, 0, blocksize-n1);
-		if (__builtin_expect(n2 < blocksize, 0))
+		}
+		if (__builtin_expect(n2 < blocksize, 0)) {
+			if (p2 != buf2 && n2 > 0)
+				memcpy(buf2, p2, n2);
+			p2=buf2;
 			memset(((char *)buf2)+n2, 0, blocksize-n2);
+		}
 		//printf("off %lld %d %d %d\n",offset2,n1,n2,verbose);
 		if (fbiout) {
 			if (__builtin_expect(n1 > n2, 0)) {
-				memcpy(((char *)buf4)+n2, ((char *)buf1)+n2, n1-n2);
+				memcpy(((char *)buf4)+n2, ((char *)p1)+n2, n1-n2);
 				fbiout->ft->ft_write(fbiout,isnotzero(buf4,bufsize),buf4,n1,offset1);
 			} else
 				fbiout->ft->ft_write(fbiout,0,buf4,n1,offset1);
 		} 
-		fout->ft->ft_write(fout,xordiff(buf1,buf2,buf3,bufsize),buf3,n2,offset2);
+		fout->ft->ft_write(fout,xordiff(p1,p2,buf3,bufsize),buf3,n2,offset2);
 		if (verbose) {
 			while (offset2 >= nextdot) {
 				nextdot+=DOTSIZE;
@@ -115,11 +128,15 @@ void xorfile(struct ioent *f1, struct ioent *f2, struct ioent *fout,
 	fout->ft->ft_truncate(fout, offset2);
 	//printf("%lld %lld\n",offset1,offset2);
 	if (f1->hash || fbiout) {
-		while ((n1=f1->ft->ft_read(f1,buf1,blocksize)) > 0) {
+		for (p1=buf1; (n1=f1->ft->ft_readptr(f1,(void **)&p1,blocksize)) > 0; p1=buf1) {
 			if (fbiout) {
-				if (__builtin_expect(n1 < blocksize,0)) 
+				if (__builtin_expect(n1 < blocksize,0)) {
+					if (p1 != buf1)
+						memcpy(buf1, p1, n1);
+					p1=buf1;
 					memset(((char *)buf1)+n1, 0, blocksize-n1);
-				fbiout->ft->ft_write(fbiout,isnotzero(buf1,bufsize),buf1,n1,offset1);
+				}
+				fbiout->ft->ft_write(fbiout,isnotzero(p1,bufsize),p1,n1,offset1);
 				offset1 += n1;
 				if (verbose) {
 					while (offset2 >= nextdot) {
@@ -142,7 +159,8 @@ void xorfile(struct ioent *f1, struct ioent *f2, struct ioent *fout,
 
 void usage(char *progname)
 {
-	fprintf(stderr,"Usage: %s [-v] [-s bufsize] {file1 | -} file2 filediff\n",progname);
+	fprintf(stderr,"Usage: %s [-v] [-m] [-s bufsize] [--max-rate bytes] [--max-iops n]\n"
+			"       [--ioprio idle|be[:level]] [--target-latency usec] {file1 | -} file2 filediff\n",progname);
 	exit(1);
 
 }
@@ -152,6 +170,10 @@ int main(int argc, char *argv[])
 	static struct ioent f1, f2, fout, fbiout;
 	static int flags;
 	int blocksize=0;
+	double maxrate=0, maxiops=0;
+	long latency=0;
+	char *ioprio=NULL;
+	char *tail;
 
 	while (1) {
 		int option_index = 0;
@@ -159,11 +181,16 @@ int main(int argc, char *argv[])
 		static struct option long_options[] = {
 			{"help", no_argument, 0,  'h' },
 			{"verbose", no_argument, 0,  'v' },
+			{"mmap", no_argument, 0,  'm' },
 			{"bufsize", required_argument, 0,  's' },
+			{"max-rate", required_argument, 0,  OPT_MAXRATE },
+			{"max-iops", required_argument, 0,  OPT_MAXIOPS },
+			{"ioprio", required_argument, 0,  OPT_IOPRIO },
+			{"target-latency", required_argument, 0,  OPT_LATENCY },
 			{0,         0,                 0,  0 }
 		};
 
-		c = getopt_long(argc, argv, "hvs:1234",
+		c = getopt_long(argc, argv, "hvms:1234",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -171,10 +198,17 @@ int main(int argc, char *argv[])
 		switch(c) {
 			case 's' : blocksize=atoi(optarg); break;
 			case 'v': flags |= XOR_VERBOSE; break;
+			case 'm': flags |= XOR_MMAP; break;
 			case '1': f1.hash=mhash_init(MHASH_SHA1); break;
 			case '2': f2.hash=mhash_init(MHASH_SHA1); break;
 			case '3': fout.hash=mhash_init(MHASH_SHA1); break;
 			case '4': fbiout.hash=mhash_init(MHASH_SHA1); break;
+			case OPT_MAXRATE: if ((maxrate=iolimit_parse(optarg)) < 0) usage(argv[0]); break;
+			case OPT_MAXIOPS: if ((maxiops=iolimit_parse(optarg)) < 0) usage(argv[0]); break;
+			case OPT_IOPRIO: ioprio=optarg; break;
+			case OPT_LATENCY: latency=strtol(optarg,&tail,10);
+												if (tail == optarg || *tail || latency < 0) usage(argv[0]);
+												break;
 			case 'h': 
 			default: usage(argv[0]);
 		}
@@ -182,12 +216,28 @@ int main(int argc, char *argv[])
 
 	if (argc-optind < 3 || argc-optind > 4)
 		usage(argv[0]);
+	if (latency > 0 && maxrate == 0) {
+		fprintf(stderr,"--target-latency requires --max-rate\n");
+		exit(1);
+	}
+	if (ioprio && iolimit_ioprio(ioprio) < 0) {
+		perror("ioprio");
+		exit(1);
+	}
+	iolimit_set(maxrate, maxiops, latency);
 
 	argc -= optind-1;
 	argv += optind-1;
 
 	open_ioent(&f1,argv[1],O_RDONLY,0);
 	open_ioent(&f2,argv[2],O_RDONLY,0);
+	if (flags & XOR_MMAP) {
+		mmap_ioent(&f1);
+		mmap_ioent(&f2);
+	}
+	/* decompress or read streams ahead in a separate thread */
+	if (f1.ft != &ftfile && f1.ft != &ftmmap) async_ioent(&f1);
+	if (f2.ft != &ftfile && f2.ft != &ftmmap) async_ioent(&f2);
 	open_ioent(&fout,argv[3],O_WRONLY|O_CREAT|O_EXCL,0666);
 	if (blocksize == 0) {
 		struct stat s;